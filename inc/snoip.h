@@ -7,14 +7,31 @@
 #include <linux/socket.h>
 #include <linux/skbuff.h>
 #include <linux/net.h>
+#include <linux/netdevice.h>
+#include <linux/topology.h>
 #include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/bvec.h>
+#include <linux/uio.h>
+#include <linux/inet.h>
+#include <linux/math64.h>
+#include <linux/net_tstamp.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+#include <linux/configfs.h>
+#include <linux/mutex.h>
+#include <linux/srcu.h>
 #include <linux/slab.h>
 #include <linux/platform_device.h>
 #include <net/net_namespace.h>
 #include <net/sock.h>
+#include <net/ipv6.h>
 #include <sound/pcm.h>
 #include <sound/core.h>
 #include <sound/initval.h>
+#include <sound/control.h>
+#include <sound/tlv.h>
 
 /*
  * RTP stream
@@ -23,6 +40,60 @@
 
 #define RTP_PAYLOAD_SIZE 1446
 
+#define AES67_MAX_CHANNELS 8
+
+/* Frames per meter reading, 100ms at 48kHz */
+#define SNOIP_METER_WINDOW 4800
+
+/*
+ * Per channel level, accumulated by the payload copy. Each full window is
+ * published to peak_out/rms_out, so readers never disturb the measurement.
+ */
+struct snoip_meter {
+	uint32_t peak[AES67_MAX_CHANNELS];
+	uint64_t sum_sq[AES67_MAX_CHANNELS];
+	uint64_t frames;
+	uint32_t peak_out[AES67_MAX_CHANNELS];
+	uint32_t rms_out[AES67_MAX_CHANNELS];
+};
+
+/* Runs once per sample in the copy loops, so no branches */
+static inline void snoip_meter_sample(struct snoip_meter *meter,
+				      unsigned int c, int32_t sample)
+{
+	uint32_t mag = (sample ^ (sample >> 31)) - (sample >> 31);
+	uint32_t peak = meter->peak[c];
+
+	meter->peak[c] = peak ^ ((peak ^ mag) & -(uint32_t)(peak < mag));
+	meter->sum_sq[c] += (uint32_t)(sample * sample);
+}
+
+/* Back to silence, for when the stream stops feeding the meter */
+static inline void snoip_meter_reset(struct snoip_meter *meter)
+{
+	memset(meter, 0, sizeof(*meter));
+}
+
+/* Account for frames just metered, publishing the window once it is full */
+static inline void snoip_meter_frames(struct snoip_meter *meter,
+				      unsigned int frames)
+{
+	unsigned int c;
+
+	meter->frames += frames;
+	if (meter->frames < SNOIP_METER_WINDOW)
+		return;
+
+	for (c = 0; c < AES67_MAX_CHANNELS; c++) {
+		meter->peak_out[c] = meter->peak[c];
+		meter->rms_out[c] =
+			int_sqrt64(div64_u64(meter->sum_sq[c], meter->frames));
+		meter->peak[c] = 0;
+		meter->sum_sq[c] = 0;
+	}
+	meter->frames = 0;
+}
+
 struct snoip_rtp_stream {
 	bool empty;
 	uint32_t sync_source;
@@ -31,6 +102,7 @@ struct snoip_rtp_stream {
 	atomic_long_t net_writer;
     atomic_long_t hw_reader;
     atomic_long_t hw_writer;
+	int node;
 	uint32_t *packet_info;
 	uint32_t *timestamp;
 	uint32_t *csrc;
@@ -54,14 +126,108 @@ struct snd_aes67_vhw {
 };
 
 
+/* unicast receivers a single TX stream fans out to */
+#define AES67_MAX_DESTS 32
+
+/* Q2.14 linear gain, unity is 1 << 14 */
+#define AES67_GAIN_SHIFT 14
+#define AES67_GAIN_UNITY (1 << AES67_GAIN_SHIFT)
+#define AES67_GAIN_MAX 32767
+
+/* IPv4 or IPv6 socket address, AF_UNSPEC when unset */
+union aes67_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+};
+
+/* Network parameters of a stream, published whole and swapped under SRCU */
+struct aes67_stream_config {
+	/* RX: address and port to listen on, groups are joined. TX: port */
+	union aes67_sockaddr addr;
+	/* RX: only accept the group from this sender (AF_UNSPEC for any) */
+	union aes67_sockaddr source;
+	/* RX: only accept this SSRC (0 for any). TX: SSRC to send (0 random) */
+	uint32_t ssrc;
+	/* RX: only accept this payload type (0 for any). TX: 0 sends 96 */
+	unsigned int payload_type;
+	unsigned int ptime_frames;
+	unsigned int channels;
+	unsigned int link_offset;
+	/* RTP time is media clock + clock_offset (SDP a=mediaclk:direct=) */
+	uint32_t clock_offset;
+	/* TX: receivers the stream fans out to */
+	struct sockaddr_in dests[AES67_MAX_DESTS];
+	unsigned int num_dests;
+	struct rcu_head rcu;
+};
+
+/* A capture substream reading the shared RX ring */
+struct aes67_rx_reader {
+	struct list_head list;
+	struct snd_pcm_substream *substream;
+	bool running;
+	/* holds a reference on the ring format */
+	bool has_params;
+	/* period boundary crossed by the last packet, raised outside the lock */
+	bool elapsed;
+	/* bytes moved since this reader's last period boundary */
+	unsigned int period_pos;
+	unsigned int period_bytes;
+};
+
 /* Definition of stream abstraction*/
 struct aes67_rtp_stream {
 	bool running;
+	int direction;
 	spinlock_t lock;
 	struct work_struct work;
+	/* NUMA node buffers live on and CPU work is queued on */
+	int node;
+	int cpu;
 	struct socket *socket;
     struct snd_pcm_substream *pcm_substream;
     atomic_t *head;
+	/* bytes moved since the last period boundary */
+	unsigned int period_pos;
+	struct aes67_stream_config __rcu *config;
+
+	/* RTP time of the frame at the hardware pointer and of the first one */
+	bool rtp_synced;
+	uint32_t rtp_timestamp;
+	uint32_t rtp_start;
+
+	/* Routing matrix: PCM channel c <-> stream channel route[c] */
+	uint8_t route[AES67_MAX_CHANNELS];
+	uint16_t gain[AES67_MAX_CHANNELS];
+	/* identity routing and unity gain, copy takes the fast path */
+	bool identity;
+	/* levels of the PCM channels */
+	struct snoip_meter meter;
+
+	uint8_t *rx_buf;
+
+	/*
+	 * Receive ring shared by every capture substream. It is written once
+	 * per packet and mapped into each reader, which only differ in their
+	 * pointers. The first reader to set hw_params fixes its format.
+	 * alsa-lib maps capture buffers read/write, so the mapping is not
+	 * read-only, and a reader writing into it is seen by the others.
+	 */
+	struct snd_dma_buffer ring;
+	struct list_head readers;
+	unsigned int ring_channels;
+	unsigned int ring_rate;
+	unsigned int ring_users;
+
+	/* Transmit state */
+	struct delayed_work tx_work;
+	bool txtime;
+	uint16_t sequence;
+	uint32_t sync_source;
+	/* TAI launch time of the first packet and frames sent since */
+	u64 tx_start_ns;
+	u64 tx_frames;
 
     void (*original_data_ready)(struct sock *sk);
 };
@@ -1,29 +1,33 @@
 #include <snoip.h>
 
-int snoip_rtp_stream_create(struct snoip_rtp_stream **stream, size_t size)
+// node is the NUMA node of the NIC feeding the ring, or NUMA_NO_NODE
+int snoip_rtp_stream_create(struct snoip_rtp_stream **stream, size_t size,
+			    int node)
 {
 	struct snoip_rtp_stream *strm;
 
 	*stream = NULL;
-	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+	strm = kzalloc_node(sizeof(*strm), GFP_KERNEL, node);
 	if (strm == NULL)
 		return -ENOMEM;
+	strm->node = node;
 
 	//Allocate arrays
-	strm->csrc = kzalloc(size * sizeof(uint32_t), GFP_KERNEL);
+	strm->csrc = kcalloc_node(size, sizeof(uint32_t), GFP_KERNEL, node);
 	if (strm->csrc == NULL)
 		return -ENOMEM;
 
-	strm->timestamp = kzalloc(size * sizeof(uint32_t), GFP_KERNEL);
+	strm->timestamp = kcalloc_node(size, sizeof(uint32_t), GFP_KERNEL, node);
 	if (strm->timestamp == NULL)
 		return -ENOMEM;
 
-	strm->packet_info = kzalloc(size * sizeof(uint32_t), GFP_KERNEL);
+	strm->packet_info =
+		kcalloc_node(size, sizeof(uint32_t), GFP_KERNEL, node);
 	if (strm->packet_info == NULL)
 		return -ENOMEM;
 
-	strm->data =
-		kzalloc(size * RTP_PAYLOAD_SIZE * sizeof(uint8_t), GFP_KERNEL);
+	strm->data = kvzalloc_node(size * RTP_PAYLOAD_SIZE * sizeof(uint8_t),
+				   GFP_KERNEL, node);
 	if (strm->data == NULL)
 		return -ENOMEM;
 
@@ -42,7 +46,7 @@ int snoip_rtp_stream_create(struct snoip_rtp_stream **stream, size_t size)
 void snoip_rtp_steam_free(struct snoip_rtp_stream *stream)
 {
 	if (stream->data)
-		kfree(stream->data);
+		kvfree(stream->data);
 
 	if (stream->csrc)
 		kfree(stream->csrc);
@@ -11,10 +11,24 @@ static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
 static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP;
 static int pcm_devs[SNDRV_CARDS] = { [0 ...(SNDRV_CARDS - 1)] = 1 };
 static int pcm_substreams[SNDRV_CARDS] = { [0 ...(SNDRV_CARDS - 1)] = 8 };
+static char *tx_addr[AES67_MAX_DESTS] = { "239.69.0.1" };
+static int tx_addr_count = 1;
+static char *rx_addr;
+static char *rx_source;
+static bool tx_txtime;
+static unsigned int tx_lead_us = 2000;
+static int stream_channels = 2;
+static unsigned int link_offset = 48;
+static char *net_dev;
+static int stream_cpu = -1;
 
 /* work for the network streams */
 static struct workqueue_struct *io_workqueue;
 
+/* stream configurations, swapped by configfs while the streams run */
+DEFINE_STATIC_SRCU(aes67_config_srcu);
+static DEFINE_MUTEX(aes67_config_mutex);
+
 static struct platform_device *devices[SNDRV_CARDS];
 
 #define CARD_NAME "AES67 Virtual Soundcard"
@@ -23,8 +37,26 @@ static struct platform_device *devices[SNDRV_CARDS];
 
 #define AES67_BUFFER_BYTES (32 * 1024)
 
+/* Shared capture ring, 160 whole 1ms packets of two channels */
+#define AES67_RX_RING_BYTES (160 * AES67_PTIME_FRAMES * 2 * 2)
+
 #define AES67_STREAM_RX 0
 #define AES67_STREAM_TX 1
+
+/* Shortest AES67 packet time (125us at 48kHz). Periods are whole packets */
+#define AES67_PTIME_FRAMES_MIN 6
+
+#define RTP_HEADER_SIZE 12
+
+/* 1ms packet time at 48kHz, the AES67 default */
+#define AES67_PTIME_FRAMES 48
+#define AES67_RTP_PORT 9375
+#define AES67_RTP_PAYLOAD_TYPE 96
+
+/* PCM channels exposed to the routing matrix */
+#define AES67_PCM_CHANNELS 2
+
+#define AES67_RECV_BUF_SIZE 2048
 module_param_array(index, int, NULL, 0444);
 MODULE_PARM_DESC(index, "Index value for " CARD_NAME " soundcard.");
 module_param_array(id, charp, NULL, 0444);
@@ -34,7 +66,25 @@ MODULE_PARM_DESC(enable, "Enable " CARD_NAME " soundcard.");
 module_param_array(pcm_devs, int, NULL, 0444);
 MODULE_PARM_DESC(pcm_devs, "PCM devices # (0-4) for dummy driver.");
 module_param_array(pcm_substreams, int, NULL, 0444);
-MODULE_PARM_DESC(pcm_substreams, "PCM substreams # (1-128) for dummy driver.");
+MODULE_PARM_DESC(pcm_substreams, "Capture substreams # (1-128) sharing the AES67 RX stream.");
+module_param_array(tx_addr, charp, &tx_addr_count, 0444);
+MODULE_PARM_DESC(tx_addr, "IPv4 destinations (addr[:port]) the AES67 TX stream is sent to.");
+module_param(rx_addr, charp, 0444);
+MODULE_PARM_DESC(rx_addr, "IPv4 or IPv6 address (addr[:port], [addr6]:port) the AES67 RX stream listens on, multicast groups are joined.");
+module_param(rx_source, charp, 0444);
+MODULE_PARM_DESC(rx_source, "Only receive the RX group from this sender (source-specific multicast).");
+module_param(tx_txtime, bool, 0444);
+MODULE_PARM_DESC(tx_txtime, "Schedule TX packets with SO_TXTIME launch times.");
+module_param(tx_lead_us, uint, 0444);
+MODULE_PARM_DESC(tx_lead_us, "How far ahead of the media clock TX packets are queued (us), at least two jiffies.");
+module_param(stream_channels, int, 0444);
+MODULE_PARM_DESC(stream_channels, "Audio channels carried by each AES67 stream (1-8).");
+module_param(link_offset, uint, 0444);
+MODULE_PARM_DESC(link_offset, "Receiver link offset in frames, reported as stream latency.");
+module_param(net_dev, charp, 0444);
+MODULE_PARM_DESC(net_dev, "Network interface carrying the streams, used for NUMA placement.");
+module_param(stream_cpu, int, 0444);
+MODULE_PARM_DESC(stream_cpu, "CPU to run stream work on (-1 to follow net_dev).");
 
 MODULE_AUTHOR("Preston Baxter <preston@preston-baxter.com>");
 MODULE_DESCRIPTION("AES67 Virtual Soundcard");
@@ -44,6 +94,7 @@ MODULE_LICENSE("GPL");
 /// Virtual Hardware
 ///
 static int snd_aes67_new_pcm(struct snd_aes67_vhw *virtcard);
+static int snd_aes67_new_mixer(struct snd_aes67_vhw *virtcard);
 static int snd_aes67_pcm_playback_open(struct snd_pcm_substream *substream);
 static int snd_aes67_pcm_playback_close(struct snd_pcm_substream *substream);
 static int snd_aes67_pcm_capture_open(struct snd_pcm_substream *substream);
@@ -51,26 +102,62 @@ static int snd_aes67_pcm_capture_close(struct snd_pcm_substream *substream);
 static int snd_aes67_pcm_hw_params(struct snd_pcm_substream *substream,
 				   struct snd_pcm_hw_params *hw_params);
 static int snd_aes67_pcm_hw_free(struct snd_pcm_substream *substream);
+static int snd_aes67_pcm_capture_hw_params(struct snd_pcm_substream *substream,
+					   struct snd_pcm_hw_params *hw_params);
+static int snd_aes67_pcm_capture_hw_free(struct snd_pcm_substream *substream);
+static int snd_aes67_pcm_capture_ioctl(struct snd_pcm_substream *substream,
+				       unsigned int cmd, void *arg);
+static int snd_aes67_pcm_capture_copy(struct snd_pcm_substream *substream,
+				      int channel, unsigned long pos,
+				      struct iov_iter *iter,
+				      unsigned long bytes);
 static int snd_aes67_pcm_prepare(struct snd_pcm_substream *substream);
 static int snd_aes67_pcm_trigger(struct snd_pcm_substream *substream, int cmd);
 static snd_pcm_uframes_t
 snd_aes67_pcm_playback_pointer(struct snd_pcm_substream *substream);
 static snd_pcm_uframes_t
 snd_aes67_pcm_capture_pointer(struct snd_pcm_substream *substream);
+static int snd_aes67_pcm_get_time_info(
+	struct snd_pcm_substream *substream, struct timespec64 *system_ts,
+	struct timespec64 *audio_ts,
+	struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+	struct snd_pcm_audio_tstamp_report *audio_tstamp_report);
 static int snd_aes67_free(struct snd_aes67_vhw *virtcard);
 static int snd_aes67_dev_free(struct snd_device *device);
 
 static void aes67_rtp_stream_free(struct aes67_rtp_stream *stream);
-static int aes67_rtp_stream_create(struct aes67_rtp_stream **stream);
+static int aes67_rtp_stream_create(struct aes67_rtp_stream **stream,
+				   int direction);
+static void aes67_rtp_tx_net(struct work_struct *work);
+static void aes67_rtp_tx_start(struct aes67_rtp_stream *stream,
+			       struct snd_pcm_runtime *runtime);
 static void aes67_rtp_data_ready(struct sock *sk);
 static void aes67_rtp_rx(struct work_struct *work);
 static int aes67_rtp_rx_write_dma(struct aes67_rtp_stream *stream,
+				  const struct aes67_stream_config *cfg,
 				  uint8_t *packet, ssize_t packet_len);
+static void aes67_rtp_stream_update_identity(struct aes67_rtp_stream *stream);
+static void aes67_copy_from_net(struct aes67_rtp_stream *stream,
+				int16_t *dst, const __be16 *src,
+				unsigned int frames, unsigned int channels,
+				unsigned int net_channels);
+static void aes67_copy_to_net(struct aes67_rtp_stream *stream, __be16 *dst,
+			      const int16_t *src, unsigned int frames,
+			      unsigned int channels, unsigned int net_channels);
+static int aes67_stream_config_check(const struct aes67_stream_config *cfg);
+static uint32_t aes67_media_clock(u64 tai_ns, unsigned int rate);
+static uint32_t aes67_rtp_clock(const struct aes67_stream_config *cfg,
+				u64 tai_ns, unsigned int rate);
+static int aes67_configfs_register(void);
+static void aes67_configfs_unregister(void);
+static void aes67_configfs_set_card(struct snd_aes67_vhw *virtcard);
 
 /* Playback definition */
 static struct snd_pcm_hardware snd_aes67_pcm_playback_hw = {
 	.info = (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_INTERLEAVED |
-		 SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP_VALID),
+		 SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP_VALID |
+		 SNDRV_PCM_INFO_NO_PERIOD_WAKEUP | SNDRV_PCM_INFO_HAS_LINK_ATIME |
+		 SNDRV_PCM_INFO_HAS_LINK_SYNCHRONIZED_ATIME),
 	.formats = SNDRV_PCM_FMTBIT_S16_LE,
 	.rates = SNDRV_PCM_RATE_8000_48000,
 	.rate_min = 8000,
@@ -78,7 +165,7 @@ static struct snd_pcm_hardware snd_aes67_pcm_playback_hw = {
 	.channels_min = 2,
 	.channels_max = 2,
 	.buffer_bytes_max = 32768,
-	.period_bytes_min = 4096,
+	.period_bytes_min = AES67_PTIME_FRAMES_MIN * 2 * 2,
 	.period_bytes_max = 32768,
 	.periods_min = 1,
 	.periods_max = 1024,
@@ -87,7 +174,9 @@ static struct snd_pcm_hardware snd_aes67_pcm_playback_hw = {
 /* Capture definition */
 static struct snd_pcm_hardware snd_aes67_pcm_capture_hw = {
 	.info = (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_INTERLEAVED |
-		 SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP_VALID),
+		 SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP_VALID |
+		 SNDRV_PCM_INFO_NO_PERIOD_WAKEUP | SNDRV_PCM_INFO_HAS_LINK_ATIME |
+		 SNDRV_PCM_INFO_HAS_LINK_SYNCHRONIZED_ATIME),
 	.formats = SNDRV_PCM_FMTBIT_S16_LE,
 	.rates = SNDRV_PCM_RATE_8000_48000,
 	.rate_min = 8000,
@@ -95,7 +184,7 @@ static struct snd_pcm_hardware snd_aes67_pcm_capture_hw = {
 	.channels_min = 1,
 	.channels_max = 2,
 	.buffer_bytes_max = 32768,
-	.period_bytes_min = 96,
+	.period_bytes_min = AES67_PTIME_FRAMES_MIN * 1 * 2,
 	.period_bytes_max = 8192,
 	.periods_min = 2,
 	.periods_max = 1024,
@@ -110,17 +199,21 @@ static struct snd_pcm_ops snd_aes67_playback_ops = {
 	.prepare = snd_aes67_pcm_prepare,
 	.trigger = snd_aes67_pcm_trigger,
 	.pointer = snd_aes67_pcm_playback_pointer,
+	.get_time_info = snd_aes67_pcm_get_time_info,
 };
 
 /* operators */
 static struct snd_pcm_ops snd_aes67_capture_ops = {
 	.open = snd_aes67_pcm_capture_open,
 	.close = snd_aes67_pcm_capture_close,
-	.hw_params = snd_aes67_pcm_hw_params,
-	.hw_free = snd_aes67_pcm_hw_free,
+	.ioctl = snd_aes67_pcm_capture_ioctl,
+	.hw_params = snd_aes67_pcm_capture_hw_params,
+	.hw_free = snd_aes67_pcm_capture_hw_free,
 	.prepare = snd_aes67_pcm_prepare,
 	.trigger = snd_aes67_pcm_trigger,
 	.pointer = snd_aes67_pcm_capture_pointer,
+	.copy = snd_aes67_pcm_capture_copy,
+	.get_time_info = snd_aes67_pcm_get_time_info,
 };
 
 /* Constructor */
@@ -149,12 +242,12 @@ static int snd_aes67_create(struct snd_card *card,
 	}
 
 	/* Create Streams */
-	err = aes67_rtp_stream_create(&virtcard->rx);
+	err = aes67_rtp_stream_create(&virtcard->rx, AES67_STREAM_RX);
 	if (err < 0) {
 		printk(KERN_ERR "Failed to create AES67 RX stream\n");
 		goto init_fail;
 	}
-	err = aes67_rtp_stream_create(&virtcard->tx);
+	err = aes67_rtp_stream_create(&virtcard->tx, AES67_STREAM_TX);
 	if (err < 0) {
 		printk(KERN_ERR "Failed to create AES67 TX stream\n");
 		goto init_fail;
@@ -166,6 +259,13 @@ static int snd_aes67_create(struct snd_card *card,
 		printk(KERN_ERR "Failed to create PCM for AES67 device\n");
 		goto init_fail;
 	}
+
+	/* Add routing and gain controls */
+	err = snd_aes67_new_mixer(virtcard);
+	if (err < 0) {
+		printk(KERN_ERR "Failed to create mixer for AES67 device\n");
+		goto init_fail;
+	}
 	goto success;
 
 init_fail:
@@ -174,6 +274,7 @@ init_fail:
 
 success:
 	printk(KERN_INFO "Successfully created AES67\n");
+	aes67_configfs_set_card(virtcard);
 	*rvirtcard = virtcard;
 	return 0;
 }
@@ -186,6 +287,8 @@ static int snd_aes67_dev_free(struct snd_device *device)
 
 static int snd_aes67_free(struct snd_aes67_vhw *virtcard)
 {
+	aes67_configfs_set_card(NULL);
+
 	/* free card */
 	printk(KERN_INFO "Freeing Soundcard\n");
 	snd_card_free(virtcard->card);
@@ -208,10 +311,12 @@ static int snd_aes67_free(struct snd_aes67_vhw *virtcard)
 static int snd_aes67_new_pcm(struct snd_aes67_vhw *virtcard)
 {
 	struct snd_pcm *pcm;
+	int dev = to_platform_device(virtcard->card->dev)->id;
 	int err;
 
 	printk(KERN_INFO "Initializing PCM for Virtual Soundcard");
-	err = snd_pcm_new(virtcard->card, CARD_NAME, 0, 1, 1, &pcm);
+	err = snd_pcm_new(virtcard->card, CARD_NAME, 0, 1,
+			  clamp(pcm_substreams[dev], 1, 128), &pcm);
 	if (err < 0) {
 		printk(KERN_INFO
 		       "Failed initializing PCM for Virtual Soundcard");
@@ -228,31 +333,286 @@ static int snd_aes67_new_pcm(struct snd_aes67_vhw *virtcard)
 			&snd_aes67_playback_ops);
 	printk(KERN_INFO "Setting PCM Capture ops");
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_aes67_capture_ops);
-	/*Da buffers*/
+	/* Da buffers, capture substreams all map the RX stream's ring */
 	printk(KERN_INFO "Setting PCM managed buffer");
-	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS,
-					      NULL, AES67_BUFFER_BYTES,
-					      AES67_BUFFER_BYTES);
+	snd_pcm_lib_preallocate_pages(
+		pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream,
+		SNDRV_DMA_TYPE_CONTINUOUS, NULL, AES67_BUFFER_BYTES,
+		AES67_BUFFER_BYTES);
+
+	return 0;
+}
+
+static struct aes67_rtp_stream *
+snd_aes67_ctl_stream(struct snd_kcontrol *kcontrol)
+{
+	struct snd_aes67_vhw *chip = snd_kcontrol_chip(kcontrol);
+
+	if (kcontrol->private_value == AES67_STREAM_TX)
+		return chip->tx;
+	return chip->rx;
+}
+
+static int snd_aes67_route_info(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = AES67_PCM_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = AES67_MAX_CHANNELS - 1;
+	return 0;
+}
+
+static int snd_aes67_route_get(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	int c;
+
+	spin_lock(&stream->lock);
+	for (c = 0; c < AES67_PCM_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = stream->route[c];
+	spin_unlock(&stream->lock);
+	return 0;
+}
+
+static int snd_aes67_route_put(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	struct aes67_stream_config *cfg;
+	int c, changed = 0;
+
+	spin_lock(&stream->lock);
+	cfg = rcu_dereference_protected(stream->config,
+					lockdep_is_held(&stream->lock));
+	for (c = 0; c < AES67_PCM_CHANNELS; c++) {
+		long route = ucontrol->value.integer.value[c];
+
+		if (route < 0 || route >= cfg->channels) {
+			spin_unlock(&stream->lock);
+			return -EINVAL;
+		}
+	}
+	for (c = 0; c < AES67_PCM_CHANNELS; c++) {
+		if (stream->route[c] != ucontrol->value.integer.value[c]) {
+			stream->route[c] = ucontrol->value.integer.value[c];
+			changed = 1;
+		}
+	}
+	aes67_rtp_stream_update_identity(stream);
+	spin_unlock(&stream->lock);
+	return changed;
+}
+
+static int snd_aes67_gain_info(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = AES67_PCM_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = AES67_GAIN_MAX;
+	return 0;
+}
+
+static int snd_aes67_gain_get(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	int c;
+
+	spin_lock(&stream->lock);
+	for (c = 0; c < AES67_PCM_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = stream->gain[c];
+	spin_unlock(&stream->lock);
+	return 0;
+}
+
+static int snd_aes67_gain_put(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	int c, changed = 0;
+
+	spin_lock(&stream->lock);
+	for (c = 0; c < AES67_PCM_CHANNELS; c++) {
+		long gain = clamp_val(ucontrol->value.integer.value[c], 0,
+				      AES67_GAIN_MAX);
+
+		if (stream->gain[c] != gain) {
+			stream->gain[c] = gain;
+			changed = 1;
+		}
+	}
+	aes67_rtp_stream_update_identity(stream);
+	spin_unlock(&stream->lock);
+	return changed;
+}
+
+static int snd_aes67_meter_info(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = AES67_PCM_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = 32768;
+	return 0;
+}
+
+/* Peak of the last completed meter window */
+static int snd_aes67_peak_get(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	int c;
 
+	spin_lock(&stream->lock);
+	for (c = 0; c < AES67_PCM_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = stream->meter.peak_out[c];
+	spin_unlock(&stream->lock);
+	return 0;
+}
+
+/* RMS of the last completed meter window */
+static int snd_aes67_rms_get(struct snd_kcontrol *kcontrol,
+			     struct snd_ctl_elem_value *ucontrol)
+{
+	struct aes67_rtp_stream *stream = snd_aes67_ctl_stream(kcontrol);
+	int c;
+
+	spin_lock(&stream->lock);
+	for (c = 0; c < AES67_PCM_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = stream->meter.rms_out[c];
+	spin_unlock(&stream->lock);
+	return 0;
+}
+
+/* Meters read out in full scale sample units */
+static const DECLARE_TLV_DB_LINEAR(snd_aes67_meter_tlv, TLV_DB_GAIN_MUTE, 0);
+
+/* Linear gain, 0 is mute and AES67_GAIN_MAX is roughly +6dB */
+static const DECLARE_TLV_DB_LINEAR(snd_aes67_gain_tlv, TLV_DB_GAIN_MUTE, 602);
+
+static const struct snd_kcontrol_new snd_aes67_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Capture Route",
+		.info = snd_aes67_route_info,
+		.get = snd_aes67_route_get,
+		.put = snd_aes67_route_put,
+		.private_value = AES67_STREAM_RX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Capture Volume",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_gain_info,
+		.get = snd_aes67_gain_get,
+		.put = snd_aes67_gain_put,
+		.tlv = { .p = snd_aes67_gain_tlv },
+		.private_value = AES67_STREAM_RX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Capture Peak",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_meter_info,
+		.get = snd_aes67_peak_get,
+		.tlv = { .p = snd_aes67_meter_tlv },
+		.private_value = AES67_STREAM_RX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Capture RMS",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_meter_info,
+		.get = snd_aes67_rms_get,
+		.tlv = { .p = snd_aes67_meter_tlv },
+		.private_value = AES67_STREAM_RX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback Route",
+		.info = snd_aes67_route_info,
+		.get = snd_aes67_route_get,
+		.put = snd_aes67_route_put,
+		.private_value = AES67_STREAM_TX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback Volume",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_gain_info,
+		.get = snd_aes67_gain_get,
+		.put = snd_aes67_gain_put,
+		.tlv = { .p = snd_aes67_gain_tlv },
+		.private_value = AES67_STREAM_TX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback Peak",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_meter_info,
+		.get = snd_aes67_peak_get,
+		.tlv = { .p = snd_aes67_meter_tlv },
+		.private_value = AES67_STREAM_TX,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback RMS",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = snd_aes67_meter_info,
+		.get = snd_aes67_rms_get,
+		.tlv = { .p = snd_aes67_meter_tlv },
+		.private_value = AES67_STREAM_TX,
+	},
+};
+
+static int snd_aes67_new_mixer(struct snd_aes67_vhw *virtcard)
+{
+	int idx, err;
+
+	strcpy(virtcard->card->mixername, CARD_NAME);
+	for (idx = 0; idx < ARRAY_SIZE(snd_aes67_controls); idx++) {
+		err = snd_ctl_add(virtcard->card,
+				  snd_ctl_new1(&snd_aes67_controls[idx],
+					       virtcard));
+		if (err < 0)
+			return err;
+	}
 	return 0;
 }
 
+/* Periods may be as short as one packet but must not split one */
+static int snd_aes67_pcm_constrain_periods(struct snd_pcm_runtime *runtime)
+{
+	return snd_pcm_hw_constraint_step(runtime, 0,
+					  SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					  AES67_PTIME_FRAMES_MIN);
+}
+
 static int snd_aes67_pcm_playback_open(struct snd_pcm_substream *substream)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
 
-	/* Start transmit loop */
+	/* Attach transmit stream, the loop starts on trigger */
 	spin_lock(&chip->tx->lock);
-	if (chip->tx && !chip->tx->running) {
-		printk(KERN_INFO "Starting TX work queue\n");
-		chip->tx->running = true;
-		queue_work(io_workqueue, &chip->tx->work);
-	}
+	chip->tx->pcm_substream = substream;
 	spin_unlock(&chip->tx->lock);
 
 	runtime->hw = snd_aes67_pcm_playback_hw;
-	return 0;
+	return snd_aes67_pcm_constrain_periods(runtime);
 }
 
 static int snd_aes67_pcm_playback_close(struct snd_pcm_substream *substream)
@@ -262,42 +622,184 @@ static int snd_aes67_pcm_playback_close(struct snd_pcm_substream *substream)
 	spin_lock(&chip->tx->lock);
 	chip->tx->running = false;
 	spin_unlock(&chip->tx->lock);
+	cancel_delayed_work_sync(&chip->tx->tx_work);
+
+	spin_lock(&chip->tx->lock);
+	chip->tx->pcm_substream = NULL;
+	spin_unlock(&chip->tx->lock);
 	return 0;
 }
 
+/*
+ * Every capture substream reads the same RX ring, so one received packet
+ * is copied once however many readers there are. Readers after the first
+ * are held to the format the ring is already running in.
+ */
 static int snd_aes67_pcm_capture_open(struct snd_pcm_substream *substream)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct aes67_rtp_stream *stream = chip->rx;
+	struct aes67_rx_reader *reader;
+	unsigned int channels, rate;
+	int err;
+
+	runtime->hw = snd_aes67_pcm_capture_hw;
+	err = snd_aes67_pcm_constrain_periods(runtime);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_constraint_minmax(runtime,
+					   SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+					   stream->ring.bytes,
+					   stream->ring.bytes);
+	if (err < 0)
+		return err;
+
+	reader = kzalloc_node(sizeof(*reader), GFP_KERNEL, stream->node);
+	if (!reader)
+		return -ENOMEM;
+	reader->substream = substream;
+	runtime->private_data = reader;
+
+	spin_lock(&stream->lock);
+	channels = stream->ring_channels;
+	rate = stream->ring_rate;
+	list_add_tail_rcu(&reader->list, &stream->readers);
 
 	/* Start receive loop */
-	spin_lock(&chip->rx->lock);
-	if (chip->rx && !chip->rx->running) {
+	if (!stream->running) {
 		printk(KERN_INFO "Starting RX work queue\n");
-		chip->rx->running = true;
-		chip->rx->pcm_substream = substream;
+		stream->running = true;
 
-		INIT_WORK(&chip->rx->work, aes67_rtp_rx);
-
-		struct sock *sk = chip->rx->socket->sk;
-		chip->rx->original_data_ready = sk->sk_data_ready;
-		sk->sk_user_data = chip->rx;
+		struct sock *sk = stream->socket->sk;
+		stream->original_data_ready = sk->sk_data_ready;
+		sk->sk_user_data = stream;
 		sk->sk_data_ready = aes67_rtp_data_ready;
 	}
-	spin_unlock(&chip->rx->lock);
+	spin_unlock(&stream->lock);
 
-	runtime->hw = snd_aes67_pcm_capture_hw;
+	if (channels) {
+		snd_pcm_hw_constraint_single(runtime,
+					     SNDRV_PCM_HW_PARAM_CHANNELS,
+					     channels);
+		snd_pcm_hw_constraint_single(runtime, SNDRV_PCM_HW_PARAM_RATE,
+					     rate);
+	}
 	return 0;
 }
 
 static int snd_aes67_pcm_capture_close(struct snd_pcm_substream *substream)
 {
 	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct aes67_rtp_stream *stream = chip->rx;
+	struct aes67_rx_reader *reader = substream->runtime->private_data;
+	bool last;
 
-	spin_lock(&chip->rx->lock);
-	chip->tx->running = false;
-	cancel_work(&chip->rx->work);
-	spin_unlock(&chip->rx->lock);
+	spin_lock(&stream->lock);
+	list_del_rcu(&reader->list);
+	last = list_empty(&stream->readers);
+	if (last) {
+		stream->running = false;
+		stream->socket->sk->sk_data_ready = stream->original_data_ready;
+		snoip_meter_reset(&stream->meter);
+	}
+	spin_unlock(&stream->lock);
+
+	/* the receive work may still be raising a period on this reader */
+	if (last)
+		cancel_work_sync(&stream->work);
+	else
+		flush_work(&stream->work);
+	kfree(reader);
+	return 0;
+}
+
+static int snd_aes67_pcm_capture_hw_params(struct snd_pcm_substream *substream,
+					   struct snd_pcm_hw_params *hw_params)
+{
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct aes67_rtp_stream *stream = chip->rx;
+	struct aes67_rx_reader *reader = substream->runtime->private_data;
+	int err = 0;
+
+	spin_lock(&stream->lock);
+	if (stream->ring_users - reader->has_params == 0) {
+		/* new format, start the ring over on a frame boundary */
+		stream->ring_channels = params_channels(hw_params);
+		stream->ring_rate = params_rate(hw_params);
+		atomic_set(stream->head, 0);
+		stream->rtp_synced = false;
+	} else if (stream->ring_channels != params_channels(hw_params) ||
+		   stream->ring_rate != params_rate(hw_params)) {
+		err = -EBUSY;
+	}
+	if (!err && !reader->has_params) {
+		reader->has_params = true;
+		stream->ring_users++;
+	}
+	spin_unlock(&stream->lock);
+	if (err < 0)
+		return err;
+
+	snd_pcm_set_runtime_buffer(substream, &stream->ring);
+	return 0;
+}
+
+static int snd_aes67_pcm_capture_hw_free(struct snd_pcm_substream *substream)
+{
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct aes67_rtp_stream *stream = chip->rx;
+	struct aes67_rx_reader *reader = substream->runtime->private_data;
+
+	spin_lock(&stream->lock);
+	if (reader->has_params) {
+		reader->has_params = false;
+		if (--stream->ring_users == 0)
+			stream->ring_channels = 0;
+	}
+	spin_unlock(&stream->lock);
+
+	snd_pcm_set_runtime_buffer(substream, NULL);
+	return 0;
+}
+
+/*
+ * read() readers. Having a copy op also keeps the PCM core from clearing
+ * the buffer on hw_params, which here would wipe the ring under the other
+ * readers.
+ */
+static int snd_aes67_pcm_capture_copy(struct snd_pcm_substream *substream,
+				      int channel, unsigned long pos,
+				      struct iov_iter *iter,
+				      unsigned long bytes)
+{
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+
+	if (copy_to_iter(chip->rx->ring.area + pos, bytes, iter) != bytes)
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * A reader joins the ring wherever the network has got to. Start its
+ * hardware pointer at the ring head, rather than at zero, so that frame
+ * positions match offsets in the shared buffer and mmap readers see the
+ * right data.
+ */
+static int snd_aes67_pcm_capture_ioctl(struct snd_pcm_substream *substream,
+				       unsigned int cmd, void *arg)
+{
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	if (cmd != SNDRV_PCM_IOCTL1_RESET)
+		return snd_pcm_lib_ioctl(substream, cmd, arg);
+
+	snd_pcm_stream_lock_irq(substream);
+	runtime->status->hw_ptr =
+		bytes_to_frames(runtime, atomic_read(chip->rx->head));
+	runtime->hw_ptr_wrap = 0;
+	snd_pcm_stream_unlock_irq(substream);
 	return 0;
 }
 
@@ -336,50 +838,210 @@ static int snd_aes67_pcm_hw_params(struct snd_pcm_substream *substream,
 	return 0;
 }
 
-/* hw_free callback */
+/* hw_free callback, only used by playback */
 static int snd_aes67_pcm_hw_free(struct snd_pcm_substream *substream)
 {
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+
+	/* STOP only clears running, a pass may still be reading the buffer */
+	cancel_delayed_work_sync(&chip->tx->tx_work);
 	return snd_pcm_lib_free_pages(substream);
-	return 0;
+}
+
+/* Any capture substream still running on the ring, stream lock held */
+static bool aes67_rx_readers_running(struct aes67_rtp_stream *stream)
+{
+	struct aes67_rx_reader *reader;
+
+	list_for_each_entry(reader, &stream->readers, list) {
+		if (reader->running)
+			return true;
+	}
+	return false;
 }
 
 static int snd_aes67_pcm_prepare(struct snd_pcm_substream *substream)
 {
-	/* set up the hardware with the current configuration
-         * for example...
-         */
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct aes67_rx_reader *reader;
+	struct aes67_rtp_stream *stream;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		/* the ring keeps running, line the periods up with its head */
+		stream = chip->rx;
+		reader = runtime->private_data;
+		spin_lock(&stream->lock);
+		reader->period_bytes =
+			frames_to_bytes(runtime, runtime->period_size);
+		reader->period_pos =
+			atomic_read(stream->head) % reader->period_bytes;
+		reader->elapsed = false;
+		if (!aes67_rx_readers_running(stream)) {
+			stream->rtp_synced = false;
+			snoip_meter_reset(&stream->meter);
+		}
+		spin_unlock(&stream->lock);
+		return 0;
+	}
+	stream = chip->tx;
+
+	/* STOP only clears running, let a pass in flight finish first */
+	cancel_delayed_work_sync(&stream->tx_work);
+
+	/* restart the engine at the top of the buffer */
+	spin_lock(&stream->lock);
+	atomic_set(stream->head, 0);
+	stream->period_pos = 0;
+	stream->rtp_synced = false;
+	snoip_meter_reset(&stream->meter);
+	spin_unlock(&stream->lock);
 	return 0;
 }
 
 static int snd_aes67_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct aes67_rx_reader *reader = substream->runtime->private_data;
+
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+			aes67_rtp_tx_start(chip->tx, substream->runtime);
+		} else {
+			spin_lock(&chip->rx->lock);
+			reader->running = true;
+			spin_unlock(&chip->rx->lock);
+		}
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
-		/* do something to stop the PCM engine */
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+			spin_lock(&chip->tx->lock);
+			chip->tx->running = false;
+			snoip_meter_reset(&chip->tx->meter);
+			spin_unlock(&chip->tx->lock);
+		} else {
+			spin_lock(&chip->rx->lock);
+			reader->running = false;
+			if (!aes67_rx_readers_running(chip->rx))
+				snoip_meter_reset(&chip->rx->meter);
+			spin_unlock(&chip->rx->lock);
+		}
 		break;
 	default:
 		return -EINVAL;
 	}
 
-	return -EINVAL;
+	return 0;
+}
+
+/*
+ * Latency outside the ring buffer, on top of the link offset. Capture data
+ * at the pointer is as old as the distance between its RTP time and the
+ * stream's RTP clock. Playback data has been queued ahead of it. A transit
+ * outside a second means the clock offset is wrong or the stream has not
+ * settled, and is left out rather than reported.
+ */
+static snd_pcm_sframes_t aes67_rtp_stream_delay(struct aes67_rtp_stream *stream,
+					       struct snd_pcm_runtime *runtime)
+{
+	struct aes67_stream_config *cfg;
+	snd_pcm_sframes_t delay;
+	uint32_t now;
+	int32_t transit;
+	int idx;
+
+	idx = srcu_read_lock(&aes67_config_srcu);
+	cfg = srcu_dereference(stream->config, &aes67_config_srcu);
+	delay = cfg->link_offset;
+	now = aes67_rtp_clock(cfg, ktime_get_clocktai_ns(), runtime->rate);
+	srcu_read_unlock(&aes67_config_srcu, idx);
+
+	spin_lock(&stream->lock);
+	if (stream->rtp_synced) {
+		transit = now - stream->rtp_timestamp;
+		if (stream->direction == AES67_STREAM_TX)
+			transit = -transit;
+		if (transit >= 0 && transit <= runtime->rate)
+			delay += transit;
+	}
+	spin_unlock(&stream->lock);
+
+	return delay;
 }
 
 static snd_pcm_uframes_t
 snd_aes67_pcm_capture_pointer(struct snd_pcm_substream *substream)
 {
 	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
-	return bytes_to_frames(substream->runtime, atomic_read(chip->rx->head));
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	runtime->delay = aes67_rtp_stream_delay(chip->rx, runtime);
+	return bytes_to_frames(runtime, atomic_read(chip->rx->head));
 }
 
 static snd_pcm_uframes_t
 snd_aes67_pcm_playback_pointer(struct snd_pcm_substream *substream)
 {
-	// struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
-	// unsigned int current_frame;
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	runtime->delay = aes67_rtp_stream_delay(chip->tx, runtime);
+	return bytes_to_frames(runtime, atomic_read(chip->tx->head));
+}
+
+/*
+ * The link clock is the PTP disciplined media clock, which is TAI and so
+ * synchronized with the system time. Report how far it has advanced since
+ * the first frame of this run, taken together with the system timestamp.
+ */
+static int snd_aes67_pcm_get_time_info(
+	struct snd_pcm_substream *substream, struct timespec64 *system_ts,
+	struct timespec64 *audio_ts,
+	struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+	struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct snd_aes67_vhw *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct aes67_rtp_stream *stream;
+	int32_t frames = 0;
+	uint32_t rtp_now;
+	int idx;
+	u64 now;
+
+	if (audio_tstamp_config->type_requested !=
+		    SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK &&
+	    audio_tstamp_config->type_requested !=
+		    SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_SYNCHRONIZED) {
+		audio_tstamp_report->actual_type =
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		stream = chip->rx;
+	else
+		stream = chip->tx;
+
+	idx = srcu_read_lock(&aes67_config_srcu);
+	spin_lock(&stream->lock);
+	now = ktime_get_clocktai_ns();
+	snd_pcm_gettime(runtime, system_ts);
+	rtp_now = aes67_rtp_clock(
+		srcu_dereference(stream->config, &aes67_config_srcu), now,
+		runtime->rate);
+	if (stream->rtp_synced)
+		frames = rtp_now - stream->rtp_start;
+	spin_unlock(&stream->lock);
+	srcu_read_unlock(&aes67_config_srcu, idx);
 
-	/* get the current hardware pointer */
+	*audio_ts = ns_to_timespec64(
+		div_u64((u64)max(frames, 0) * NSEC_PER_SEC, runtime->rate));
+
+	audio_tstamp_report->actual_type =
+		SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_SYNCHRONIZED;
+	audio_tstamp_report->accuracy_report = 1;
+	audio_tstamp_report->accuracy = NSEC_PER_SEC / runtime->rate;
 	return 0;
 }
 
@@ -498,119 +1160,1433 @@ static int aes67_rtp_work_start(void)
 }
 
 /* Network functions */
-static void aes67_rtp_tx_net(struct work_struct *work)
+
+/* AES67 media clock: RTP time is TAI scaled to the sample rate */
+static uint32_t aes67_media_clock(u64 tai_ns, unsigned int rate)
 {
-	printk(KERN_WARNING "Faking TX things\n");
-	return;
+	return (uint32_t)mul_u64_u32_div(tai_ns, rate, NSEC_PER_SEC);
 }
 
-static void aes67_rtp_data_ready(struct sock *sk)
+/* RTP time of a stream, the media clock moved by the sender's offset */
+static uint32_t aes67_rtp_clock(const struct aes67_stream_config *cfg,
+				u64 tai_ns, unsigned int rate)
 {
-	struct aes67_rtp_stream *stream = sk->sk_user_data;
+	return aes67_media_clock(tai_ns, rate) + cfg->clock_offset;
+}
 
-	sk->sk_data_ready = stream->original_data_ready;
+/*
+ * How far ahead packets are built. A pass runs at best once a jiffy, so
+ * anything shorter than two would leave packets due before the next pass
+ * stamped with launch times already gone.
+ */
+static u64 aes67_tx_lead_ns(void)
+{
+	return max_t(u64, (u64)tx_lead_us * NSEC_PER_USEC,
+		     2 * jiffies_to_nsecs(1));
+}
 
-	schedule_work(&stream->work);
+/* Called from trigger, so no sleeping in here */
+static void aes67_rtp_tx_start(struct aes67_rtp_stream *stream,
+			       struct snd_pcm_runtime *runtime)
+{
+	u64 now = ktime_get_clocktai_ns();
+	int idx;
 
-	if (stream->original_data_ready) {
-		stream->original_data_ready(sk);
-	}
+	idx = srcu_read_lock(&aes67_config_srcu);
+	spin_lock(&stream->lock);
+	stream->tx_start_ns = now + aes67_tx_lead_ns();
+	stream->tx_frames = 0;
+	stream->rtp_timestamp = aes67_rtp_clock(
+		srcu_dereference(stream->config, &aes67_config_srcu),
+		stream->tx_start_ns, runtime->rate);
+	stream->rtp_start = stream->rtp_timestamp;
+	stream->rtp_synced = true;
+	stream->running = true;
+	spin_unlock(&stream->lock);
+	srcu_read_unlock(&aes67_config_srcu, idx);
+
+	queue_delayed_work_on(stream->cpu, io_workqueue, &stream->tx_work, 0);
 }
 
-static void aes67_rtp_rx(struct work_struct *work)
+/*
+ * Send one packet to every destination. The packet is spliced rather than
+ * copied, so each destination's skb only adds headers and a reference to
+ * the same page, and cost does not grow with the payload per receiver.
+ */
+static int aes67_rtp_tx_send(struct aes67_rtp_stream *stream,
+			     const struct aes67_stream_config *cfg,
+			     struct page *page, size_t len, u64 launch_ns)
 {
-	struct aes67_rtp_stream *stream =
-		container_of(work, struct aes67_rtp_stream, work);
+	char control[CMSG_SPACE(sizeof(u64))] = {};
 	struct msghdr msg = {};
-	msg.msg_flags = MSG_DONTWAIT;
-	int err;
-	size_t recv_buf_size = 2048;
-	ssize_t msglen;
-	uint8_t *recv_buf;
+	struct cmsghdr *cmsg;
+	struct bio_vec bvec;
+	int i, ret, err = 0;
+
+	/* let the qdisc release the packet at its media clock time */
+	if (stream->txtime) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(u64));
+		*(u64 *)CMSG_DATA(cmsg) = launch_ns;
+	}
 
-	/* Loop Receive */
-	recv_buf = kzalloc(recv_buf_size, GFP_KERNEL);
-	if (!recv_buf) {
-		printk(KERN_ERR "Failed to allocate network receive buffer\n");
-		goto cleanup;
+	for (i = 0; i < cfg->num_dests; i++) {
+		msg.msg_name = (void *)&cfg->dests[i];
+		msg.msg_namelen = sizeof(cfg->dests[i]);
+		msg.msg_flags = MSG_DONTWAIT | MSG_SPLICE_PAGES;
+		bvec_set_page(&bvec, page, len, 0);
+		iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, len);
+
+		ret = sock_sendmsg(stream->socket, &msg);
+		if (ret < 0)
+			err = ret;
 	}
 
-	struct kvec iv;
-	iv.iov_base = recv_buf;
-	iv.iov_len = recv_buf_size;
+	return err;
+}
 
-	msglen = kernel_recvmsg(stream->socket, &msg, &iv, 1, iv.iov_len,
-				msg.msg_flags);
+/*
+ * Packetize everything due before now + the TX lead. With SO_TXTIME the
+ * packets are stamped and left to the qdisc, so one pass can queue several
+ * packet times ahead. Without it they go out as soon as they are built.
+ */
+static void aes67_rtp_tx_net(struct work_struct *work)
+{
+	struct aes67_rtp_stream *stream =
+		container_of(to_delayed_work(work), struct aes67_rtp_stream,
+			     tx_work);
+	struct snd_pcm_substream *substream;
+	struct snd_pcm_runtime *runtime;
+	struct aes67_stream_config *cfg;
+	unsigned int head, period_bytes, packet_bytes, dma_bytes, chunk, len;
+	struct page *page;
+	uint8_t *packet;
+	__be16 *dst;
+	bool elapsed = false;
+	u64 horizon, launch;
+	int err, idx;
 
-	if (msglen < 0) {
-		printk(KERN_ERR "error receiving packet: %zd\n", msglen);
-		goto cleanup;
+	spin_lock(&stream->lock);
+	substream = stream->pcm_substream;
+	if (!stream->running || !substream || !substream->runtime ||
+	    !substream->runtime->dma_area) {
+		spin_unlock(&stream->lock);
+		return;
 	}
+	spin_unlock(&stream->lock);
 
-	if (msglen > 0) {
-		err = aes67_rtp_rx_write_dma(stream, recv_buf, msglen);
+	/* one configuration for the whole pass, configfs may swap it */
+	idx = srcu_read_lock(&aes67_config_srcu);
+	cfg = srcu_dereference(stream->config, &aes67_config_srcu);
+
+	runtime = substream->runtime;
+	packet_bytes = cfg->ptime_frames * cfg->channels * sizeof(*dst);
+	dma_bytes = frames_to_bytes(runtime, cfg->ptime_frames);
+	period_bytes = frames_to_bytes(runtime, runtime->period_size);
+	if (RTP_HEADER_SIZE + packet_bytes > RTP_PAYLOAD_SIZE) {
+		printk(KERN_ERR "AES67 TX packet too large: %u bytes\n",
+		       packet_bytes);
+		srcu_read_unlock(&aes67_config_srcu, idx);
+		return;
+	}
 
+	horizon = ktime_get_clocktai_ns() + aes67_tx_lead_ns();
+	for (;;) {
+		/* fresh page per packet, queued skbs keep their reference */
+		page = alloc_pages_node(stream->node, GFP_KERNEL, 0);
+		if (!page) {
+			printk_ratelimited(KERN_ERR
+					   "AES67 TX failed to allocate packet\n");
+			break;
+		}
+		packet = page_address(page);
+
+		/* the pointer callback reads the timeline under the lock */
+		spin_lock(&stream->lock);
+		launch = stream->tx_start_ns +
+			 div_u64(stream->tx_frames * NSEC_PER_SEC,
+				 runtime->rate);
+		if (!stream->running || launch > horizon) {
+			spin_unlock(&stream->lock);
+			put_page(page);
+			break;
+		}
+
+		packet[0] = 0x80;
+		packet[1] = cfg->payload_type ?: AES67_RTP_PAYLOAD_TYPE;
+		*(__be16 *)(packet + 2) = htons(stream->sequence++);
+		*(__be32 *)(packet + 4) = htonl(stream->rtp_timestamp);
+		*(__be32 *)(packet + 8) = htonl(stream->sync_source);
+
+		dst = (__be16 *)(packet + RTP_HEADER_SIZE);
+		head = atomic_read(stream->head);
+		for (len = 0; len < dma_bytes; len += chunk) {
+			chunk = min(dma_bytes - len,
+				    (unsigned int)runtime->dma_bytes - head);
+			aes67_copy_to_net(stream, dst,
+					  (int16_t *)(runtime->dma_area + head),
+					  bytes_to_frames(runtime, chunk),
+					  runtime->channels, cfg->channels);
+			dst += bytes_to_frames(runtime, chunk) * cfg->channels;
+			head = (head + chunk) % runtime->dma_bytes;
+		}
+		atomic_set(stream->head, head);
+
+		stream->tx_frames += cfg->ptime_frames;
+		stream->rtp_timestamp += cfg->ptime_frames;
+		stream->period_pos += dma_bytes;
+		if (stream->period_pos >= period_bytes) {
+			stream->period_pos %= period_bytes;
+			elapsed = true;
+		}
+		spin_unlock(&stream->lock);
+
+		err = aes67_rtp_tx_send(stream, cfg, page,
+					RTP_HEADER_SIZE + packet_bytes, launch);
+		put_page(page);
 		if (err < 0)
-			printk(KERN_ERR "Failed to write to rtp stream %d\n",
-			       err);
+			printk_ratelimited(KERN_ERR
+					   "AES67 TX send failed: %d\n", err);
 	}
 
-cleanup:
+	srcu_read_unlock(&aes67_config_srcu, idx);
+
+	if (elapsed && !runtime->no_period_wakeup)
+		snd_pcm_period_elapsed(substream);
+
 	spin_lock(&stream->lock);
-	if (stream->running) {
-		stream->socket->sk->sk_data_ready = aes67_rtp_data_ready;
-	}
+	if (stream->running)
+		queue_delayed_work_on(stream->cpu, io_workqueue,
+				      &stream->tx_work, 1);
 	spin_unlock(&stream->lock);
-	return;
 }
 
-static void aes67_rtp_stream_free(struct aes67_rtp_stream *stream)
+static void aes67_rtp_data_ready(struct sock *sk)
 {
-	stream->running = false;
-	if (stream->socket && stream->socket->ops) {
-		stream->socket->ops->release(stream->socket);
-	}
+	struct aes67_rtp_stream *stream = sk->sk_user_data;
 
-	if (stream->head) {
-		kfree(stream->head);
-	}
+	sk->sk_data_ready = stream->original_data_ready;
 
-	kfree(stream);
-}
+	queue_work_on(stream->cpu, io_workqueue, &stream->work);
 
-static int aes67_rtp_stream_create(struct aes67_rtp_stream **stream)
+	if (stream->original_data_ready) {
+		stream->original_data_ready(sk);
+	}
+}
+
+/*
+ * Group and source filtering happen in the IP layer, this catches other
+ * senders sharing the group before anything is parsed or copied.
+ */
+static inline bool aes67_rtp_rx_accept(const struct aes67_stream_config *cfg,
+				       const uint8_t *packet, ssize_t len)
 {
-	struct aes67_rtp_stream *strm;
-	int err;
+	if (len < RTP_HEADER_SIZE || (packet[0] & 0xC0) != 0x80)
+		return false;
+	if (cfg->payload_type && (packet[1] & 0x7F) != cfg->payload_type)
+		return false;
+	return !cfg->ssrc || ntohl(*(__be32 *)(packet + 8)) == cfg->ssrc;
+}
 
-	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
-	if (!strm)
-		return -ENOMEM;
+/*
+ * Drain the socket. The data_ready hook is disarmed while this runs, so
+ * every datagram queued meanwhile has to be picked up here or it would sit
+ * in the backlog for good.
+ */
+static void aes67_rtp_rx(struct work_struct *work)
+{
+	struct aes67_rtp_stream *stream =
+		container_of(work, struct aes67_rtp_stream, work);
+	struct msghdr msg = {};
+	msg.msg_flags = MSG_DONTWAIT;
+	int err, idx;
+	ssize_t msglen;
+	uint8_t *recv_buf = stream->rx_buf;
+	struct aes67_stream_config *cfg;
+	struct sock *sk;
+	bool pending;
 
-	atomic_set(strm->head, 0);
+	/* Loop Receive */
+	struct kvec iv;
+
+	for (;;) {
+		iv.iov_base = recv_buf;
+		iv.iov_len = AES67_RECV_BUF_SIZE;
+		msglen = kernel_recvmsg(stream->socket, &msg, &iv, 1,
+					iv.iov_len, msg.msg_flags);
+		if (msglen == -EAGAIN)
+			break;
+		if (msglen < 0) {
+			printk_ratelimited(KERN_ERR
+					   "error receiving packet: %zd\n",
+					   msglen);
+			break;
+		}
+
+		idx = srcu_read_lock(&aes67_config_srcu);
+		cfg = srcu_dereference(stream->config, &aes67_config_srcu);
+		if (aes67_rtp_rx_accept(cfg, recv_buf, msglen)) {
+			err = aes67_rtp_rx_write_dma(stream, cfg, recv_buf,
+						     msglen);
+
+			/* -EAGAIN: no reader has set up the ring yet, drop */
+			if (err < 0 && err != -EAGAIN)
+				printk_ratelimited(
+					KERN_ERR
+					"Failed to write to rtp stream %d\n",
+					err);
+		}
+		srcu_read_unlock(&aes67_config_srcu, idx);
+	}
+
+	spin_lock(&stream->lock);
+	sk = stream->socket->sk;
+	pending = false;
+	if (stream->running) {
+		sk->sk_data_ready = aes67_rtp_data_ready;
+		/* a datagram may have landed between -EAGAIN and re-arming */
+		pending = !skb_queue_empty_lockless(&sk->sk_receive_queue);
+	}
+	spin_unlock(&stream->lock);
+
+	if (pending)
+		queue_work_on(stream->cpu, io_workqueue, &stream->work);
+}
+
+/* Route and gain are only applied off the identity/unity fast path */
+static void aes67_rtp_stream_update_identity(struct aes67_rtp_stream *stream)
+{
+	int c;
+
+	stream->identity = true;
+	for (c = 0; c < AES67_PCM_CHANNELS; c++) {
+		if (stream->route[c] != c || stream->gain[c] != AES67_GAIN_UNITY)
+			stream->identity = false;
+	}
+}
+
+static inline int16_t aes67_apply_gain(int16_t sample, uint16_t gain)
+{
+	return clamp_t(int32_t, ((int32_t)sample * gain) >> AES67_GAIN_SHIFT,
+		       S16_MIN, S16_MAX);
+}
+
+/*
+ * Network L16 (big endian, stream layout) to PCM S16 (PCM layout). The PCM
+ * side is metered on the way through.
+ */
+static void aes67_copy_from_net(struct aes67_rtp_stream *stream,
+				int16_t *dst, const __be16 *src,
+				unsigned int frames, unsigned int channels,
+				unsigned int net_channels)
+{
+	struct snoip_meter *meter = &stream->meter;
+	unsigned int f, c;
+
+	if (stream->identity && channels == net_channels) {
+		for (f = 0; f < frames; f++) {
+			for (c = 0; c < channels; c++) {
+				*dst = be16_to_cpu(*src++);
+				snoip_meter_sample(meter, c, *dst++);
+			}
+		}
+		snoip_meter_frames(meter, frames);
+		return;
+	}
+
+	for (f = 0; f < frames; f++) {
+		for (c = 0; c < channels; c++) {
+			dst[c] = aes67_apply_gain(
+				be16_to_cpu(src[stream->route[c]]),
+				stream->gain[c]);
+			snoip_meter_sample(meter, c, dst[c]);
+		}
+		dst += channels;
+		src += net_channels;
+	}
+	snoip_meter_frames(meter, frames);
+}
+
+/* PCM S16 (PCM layout) to network L16, unrouted stream channels are silent */
+static void aes67_copy_to_net(struct aes67_rtp_stream *stream, __be16 *dst,
+			      const int16_t *src, unsigned int frames,
+			      unsigned int channels, unsigned int net_channels)
+{
+	struct snoip_meter *meter = &stream->meter;
+	unsigned int f, c;
+	int16_t sample;
+
+	if (stream->identity && channels == net_channels) {
+		for (f = 0; f < frames; f++) {
+			for (c = 0; c < channels; c++) {
+				snoip_meter_sample(meter, c, *src);
+				*dst++ = cpu_to_be16(*src++);
+			}
+		}
+		snoip_meter_frames(meter, frames);
+		return;
+	}
+
+	memset(dst, 0, frames * net_channels * sizeof(*dst));
+	for (f = 0; f < frames; f++) {
+		for (c = 0; c < channels; c++) {
+			sample = aes67_apply_gain(src[c], stream->gain[c]);
+			snoip_meter_sample(meter, c, sample);
+			dst[stream->route[c]] = cpu_to_be16(sample);
+		}
+		dst += net_channels;
+		src += channels;
+	}
+	snoip_meter_frames(meter, frames);
+}
+
+/*
+ * Copy the payload of one RTP packet into the shared capture ring and
+ * advance the hardware pointer. Periods can be a single packet long, so the
+ * elapsed notification is raised on every boundary a reader crosses unless
+ * it asked to run without period wakeups and polls the pointer instead.
+ */
+static int aes67_rtp_rx_write_dma(struct aes67_rtp_stream *stream,
+				  const struct aes67_stream_config *cfg,
+				  uint8_t *packet, ssize_t packet_len)
+{
+	struct aes67_rx_reader *reader;
+	unsigned int head, len, offset, frames, chunk, channels, frame_bytes;
+	uint32_t timestamp;
+	const __be16 *src;
+
+	/* skip fixed header and CSRC list, drop padding */
+	offset = RTP_HEADER_SIZE + (packet[0] & 0x0F) * sizeof(uint32_t);
+	if (packet_len <= offset)
+		return -EINVAL;
+	len = packet_len - offset;
+	if (packet[0] & 0x20) {
+		if (packet[packet_len - 1] > len)
+			return -EINVAL;
+		len -= packet[packet_len - 1];
+	}
+
+	timestamp = ntohl(*(__be32 *)(packet + 4));
+
+	spin_lock(&stream->lock);
+	channels = stream->ring_channels;
+	if (!channels) {
+		spin_unlock(&stream->lock);
+		return -EAGAIN;
+	}
+	frame_bytes = channels * sizeof(int16_t);
+	src = (const __be16 *)(packet + offset);
+	frames = len / (cfg->channels * sizeof(*src));
+	if (!stream->rtp_synced) {
+		stream->rtp_start = timestamp;
+		stream->rtp_synced = true;
+	}
+	/* RTP time of the frame the hardware pointer will land on */
+	stream->rtp_timestamp = timestamp + frames;
+	head = atomic_read(stream->head);
+	len = frames * frame_bytes;
+	while (frames) {
+		chunk = min(frames, (stream->ring.bytes - head) / frame_bytes);
+		if (!chunk)
+			break;
+		aes67_copy_from_net(stream,
+				    (int16_t *)(stream->ring.area + head), src,
+				    chunk, channels, cfg->channels);
+		src += chunk * cfg->channels;
+		frames -= chunk;
+		head = (head + chunk * frame_bytes) % stream->ring.bytes;
+	}
+	atomic_set(stream->head, head);
+
+	/* only the bookkeeping is per reader, never the data */
+	list_for_each_entry(reader, &stream->readers, list) {
+		if (!reader->running || !reader->period_bytes)
+			continue;
+		reader->period_pos += len;
+		if (reader->period_pos >= reader->period_bytes) {
+			reader->period_pos %= reader->period_bytes;
+			reader->elapsed =
+				!reader->substream->runtime->no_period_wakeup;
+		}
+	}
+	spin_unlock(&stream->lock);
+
+	/* close waits for this work, so the readers stay valid under RCU */
+	rcu_read_lock();
+	list_for_each_entry_rcu(reader, &stream->readers, list) {
+		if (READ_ONCE(reader->elapsed)) {
+			WRITE_ONCE(reader->elapsed, false);
+			snd_pcm_period_elapsed(reader->substream);
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static void aes67_rtp_stream_free(struct aes67_rtp_stream *stream)
+{
+	stream->running = false;
+	cancel_delayed_work_sync(&stream->tx_work);
+	if (stream->socket && stream->socket->ops) {
+		stream->socket->ops->release(stream->socket);
+	}
+
+	if (stream->head) {
+		kfree(stream->head);
+	}
+
+	if (stream->rx_buf) {
+		kfree(stream->rx_buf);
+	}
+
+	if (stream->ring.area) {
+		__free_pages(virt_to_page(stream->ring.area),
+			     get_order(stream->ring.bytes));
+	}
+
+	/* no readers left once the work is gone */
+	kfree(rcu_dereference_protected(stream->config, true));
+	kfree(stream);
+}
 
-	/* create socket */
-	err = sock_create_kern(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_UDP,
-			       &strm->socket);
+/* "a.b.c.d" or "a.b.c.d:port" */
+static int aes67_parse_dest(const char *str, struct sockaddr_in *dest,
+			    u16 port)
+{
+	const char *end;
+
+	if (!str || !in4_pton(str, -1, (u8 *)&dest->sin_addr.s_addr, ':',
+			      &end))
+		return -EINVAL;
+	if (*end == ':' && kstrtou16(end + 1, 10, &port))
+		return -EINVAL;
+
+	dest->sin_family = AF_INET;
+	dest->sin_port = htons(port);
+	return 0;
+}
+
+static u16 aes67_sockaddr_port(const union aes67_sockaddr *addr)
+{
+	if (addr->sa.sa_family == AF_INET6)
+		return ntohs(addr->v6.sin6_port);
+	return ntohs(addr->v4.sin_port);
+}
+
+static void aes67_sockaddr_set_port(union aes67_sockaddr *addr, u16 port)
+{
+	if (addr->sa.sa_family == AF_INET6)
+		addr->v6.sin6_port = htons(port);
+	else
+		addr->v4.sin_port = htons(port);
+}
+
+static bool aes67_sockaddr_is_multicast(const union aes67_sockaddr *addr)
+{
+	if (addr->sa.sa_family == AF_INET6)
+		return ipv6_addr_is_multicast(&addr->v6.sin6_addr);
+	return ipv4_is_multicast(addr->v4.sin_addr.s_addr);
+}
+
+/* "a.b.c.d", "a.b.c.d:port", "a:b::c" or "[a:b::c]:port" */
+static int aes67_parse_addr(const char *str, union aes67_sockaddr *addr,
+			    u16 port)
+{
+	const char *end;
+
+	if (!str)
+		return -EINVAL;
+
+	memset(addr, 0, sizeof(*addr));
+	if (in4_pton(str, -1, (u8 *)&addr->v4.sin_addr.s_addr, ':', &end)) {
+		addr->sa.sa_family = AF_INET;
+	} else if (*str == '[' &&
+		   in6_pton(str + 1, -1, addr->v6.sin6_addr.s6_addr, ']',
+			    &end)) {
+		addr->sa.sa_family = AF_INET6;
+		end++;
+	} else if (in6_pton(str, -1, addr->v6.sin6_addr.s6_addr, -1, &end)) {
+		addr->sa.sa_family = AF_INET6;
+	} else {
+		return -EINVAL;
+	}
+	if (*end == ':' && kstrtou16(end + 1, 10, &port))
+		return -EINVAL;
+
+	aes67_sockaddr_set_port(addr, port);
+	return 0;
+}
+
+/* Interface named by net_dev, 0 lets the routing table pick one */
+static int aes67_net_ifindex(void)
+{
+	struct net_device *ndev;
+	int ifindex;
+
+	if (!net_dev)
+		return 0;
+	ndev = dev_get_by_name(&init_net, net_dev);
+	if (!ndev)
+		return 0;
+	ifindex = ndev->ifindex;
+	dev_put(ndev);
+	return ifindex;
+}
+
+/*
+ * Streams live on the NUMA node of the receiving NIC, or of stream_cpu when
+ * one is given, so packet data is not pulled across sockets.
+ */
+static void aes67_rtp_stream_placement(int *node, int *cpu)
+{
+	struct net_device *ndev;
+
+	*node = NUMA_NO_NODE;
+	*cpu = WORK_CPU_UNBOUND;
+
+	if (stream_cpu >= 0) {
+		if (stream_cpu < nr_cpu_ids && cpu_online(stream_cpu)) {
+			*cpu = stream_cpu;
+			*node = cpu_to_node(stream_cpu);
+			return;
+		}
+		printk(KERN_WARNING "AES67 stream_cpu %d is not online, using the NIC node\n",
+		       stream_cpu);
+	}
+
+	if (!net_dev)
+		return;
+
+	ndev = dev_get_by_name(&init_net, net_dev);
+	if (!ndev) {
+		printk(KERN_WARNING "AES67 interface %s not found\n", net_dev);
+		return;
+	}
+	if (ndev->dev.parent)
+		*node = dev_to_node(ndev->dev.parent);
+	dev_put(ndev);
+
+	if (*node != NUMA_NO_NODE) {
+		*cpu = cpumask_any_and(cpumask_of_node(*node), cpu_online_mask);
+		if (*cpu >= nr_cpu_ids)
+			*cpu = WORK_CPU_UNBOUND;
+	}
+}
+
+/* Stream parameters as given on the module command line */
+static int aes67_stream_config_init(struct aes67_stream_config *cfg,
+				    int direction)
+{
+	int i, err;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->addr.v4.sin_family = AF_INET;
+	cfg->addr.v4.sin_port = htons(AES67_RTP_PORT);
+	cfg->addr.v4.sin_addr.s_addr = htonl(INADDR_ANY);
+	cfg->ptime_frames = AES67_PTIME_FRAMES;
+	cfg->channels = clamp(stream_channels, 1, AES67_MAX_CHANNELS);
+	cfg->link_offset = link_offset;
+
+	if (direction != AES67_STREAM_TX) {
+		if (rx_addr &&
+		    aes67_parse_addr(rx_addr, &cfg->addr, AES67_RTP_PORT)) {
+			printk(KERN_ERR "Invalid AES67 RX address %s\n", rx_addr);
+			return -EINVAL;
+		}
+		if (rx_source && aes67_parse_addr(rx_source, &cfg->source, 0)) {
+			printk(KERN_ERR "Invalid AES67 RX source %s\n",
+			       rx_source);
+			return -EINVAL;
+		}
+		return aes67_stream_config_check(cfg);
+	}
+
+	for (i = 0; i < tx_addr_count; i++) {
+		err = aes67_parse_dest(tx_addr[i], &cfg->dests[cfg->num_dests],
+				       AES67_RTP_PORT);
+		if (err < 0) {
+			printk(KERN_ERR "Invalid AES67 TX address %s\n",
+			       tx_addr[i]);
+			return err;
+		}
+		cfg->num_dests++;
+	}
+	return 0;
+}
+
+static int aes67_stream_config_check(const struct aes67_stream_config *cfg)
+{
+	if (cfg->channels < 1 || cfg->channels > AES67_MAX_CHANNELS)
+		return -EINVAL;
+	if (cfg->payload_type > 127)
+		return -EINVAL;
+	/* a source only narrows a group of its own family */
+	if (cfg->source.sa.sa_family != AF_UNSPEC &&
+	    (cfg->source.sa.sa_family != cfg->addr.sa.sa_family ||
+	     !aes67_sockaddr_is_multicast(&cfg->addr)))
+		return -EINVAL;
+	if (cfg->ptime_frames < AES67_PTIME_FRAMES_MIN ||
+	    RTP_HEADER_SIZE + cfg->ptime_frames * cfg->channels * 2 >
+		    RTP_PAYLOAD_SIZE)
+		return -EINVAL;
+	return 0;
+}
+
+static void aes67_stream_config_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct aes67_stream_config, rcu));
+}
+
+/*
+ * Join the multicast group the socket is bound to, from any sender or, with
+ * a source given, only from that one (IGMPv3/MLDv2 source filtering). The
+ * membership is dropped with the socket.
+ */
+static int aes67_rtp_stream_join(struct socket *sock,
+				 const struct aes67_stream_config *cfg,
+				 int ifindex)
+{
+	int level = cfg->addr.sa.sa_family == AF_INET6 ? SOL_IPV6 : SOL_IP;
+	struct group_source_req gsr = { .gsr_interface = ifindex };
+	struct group_req greq = { .gr_interface = ifindex };
+	int off = 0, err;
+
+	/* by default a wildcard port gets every group joined on the host */
+	if (level == SOL_IP)
+		err = sock->ops->setsockopt(sock, level, IP_MULTICAST_ALL,
+					    KERNEL_SOCKPTR(&off), sizeof(off));
+	else
+		err = sock->ops->setsockopt(sock, level, IPV6_MULTICAST_ALL,
+					    KERNEL_SOCKPTR(&off), sizeof(off));
+	if (err < 0)
+		return err;
+
+	if (cfg->source.sa.sa_family == AF_UNSPEC) {
+		memcpy(&greq.gr_group, &cfg->addr, sizeof(cfg->addr));
+		return sock->ops->setsockopt(sock, level, MCAST_JOIN_GROUP,
+					     KERNEL_SOCKPTR(&greq),
+					     sizeof(greq));
+	}
+
+	memcpy(&gsr.gsr_group, &cfg->addr, sizeof(cfg->addr));
+	memcpy(&gsr.gsr_source, &cfg->source, sizeof(cfg->source));
+	return sock->ops->setsockopt(sock, level, MCAST_JOIN_SOURCE_GROUP,
+				     KERNEL_SOCKPTR(&gsr), sizeof(gsr));
+}
+
+/*
+ * Open a receive socket on the configured address and make it the stream's
+ * socket. Binding to the group itself, rather than the wildcard, keeps
+ * other groups on the same port out. The old socket is only released once
+ * any receive work still using it is done.
+ */
+static int aes67_rtp_stream_bind(struct aes67_rtp_stream *stream,
+				 const struct aes67_stream_config *cfg)
+{
+	union aes67_sockaddr addr = cfg->addr;
+	int ifindex = aes67_net_ifindex();
+	struct socket *sock, *old;
+	int addrlen, err;
+
+	err = sock_create_kern(&init_net, addr.sa.sa_family, SOCK_DGRAM,
+			       IPPROTO_UDP, &sock);
 	if (err < 0) {
 		printk(KERN_ERR "Failed to create socket for stream\n");
 		return err;
 	}
+	/* the old socket holds the port until the new one has taken over */
+	sock_set_reuseaddr(sock->sk);
+
+	if (addr.sa.sa_family == AF_INET6) {
+		addrlen = sizeof(addr.v6);
+		if (__ipv6_addr_needs_scope_id(
+			    __ipv6_addr_type(&addr.v6.sin6_addr)))
+			addr.v6.sin6_scope_id = ifindex;
+	} else {
+		addrlen = sizeof(addr.v4);
+	}
 
-	struct sockaddr_in addr = { .sin_family = AF_INET,
-				    .sin_port = htons(9375),
-				    .sin_addr = { htonl(INADDR_ANY) } };
-
-	strm->socket->ops->bind(strm->socket, (struct sockaddr *)&addr,
-				sizeof(addr));
+	err = sock->ops->bind(sock, &addr.sa, addrlen);
 	if (err < 0) {
 		printk(KERN_ERR
 		       "Failed to bind socket for virtual soundcard\n");
+		sock_release(sock);
+		return err;
+	}
+
+	if (aes67_sockaddr_is_multicast(&addr)) {
+		err = aes67_rtp_stream_join(sock, cfg, ifindex);
+		if (err < 0) {
+			printk(KERN_ERR "Failed to join AES67 group %pISc\n",
+			       &addr.sa);
+			sock_release(sock);
+			return err;
+		}
+	}
+
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	sock->sk->sk_user_data = stream;
+	write_unlock_bh(&sock->sk->sk_callback_lock);
+
+	spin_lock(&stream->lock);
+	old = stream->socket;
+	stream->socket = sock;
+	stream->original_data_ready = sock->sk->sk_data_ready;
+	if (stream->running)
+		sock->sk->sk_data_ready = aes67_rtp_data_ready;
+	spin_unlock(&stream->lock);
+
+	if (old) {
+		write_lock_bh(&old->sk->sk_callback_lock);
+		old->sk->sk_data_ready = stream->original_data_ready;
+		old->sk->sk_user_data = NULL;
+		write_unlock_bh(&old->sk->sk_callback_lock);
+		flush_work(&stream->work);
+		sock_release(old);
+	}
+	return 0;
+}
+
+/*
+ * Publish a new set of stream parameters. The RX and TX paths keep using
+ * the old set until their SRCU section ends, so an edit costs at most the
+ * packet in flight and never touches the other streams.
+ */
+static int aes67_rtp_stream_apply(struct aes67_rtp_stream *stream,
+				  const struct aes67_stream_config *staged)
+{
+	struct aes67_stream_config *cfg, *old;
+	int c, err;
+
+	lockdep_assert_held(&aes67_config_mutex);
+
+	err = aes67_stream_config_check(staged);
+	if (err < 0)
 		return err;
+
+	cfg = kmalloc_node(sizeof(*cfg), GFP_KERNEL, stream->node);
+	if (!cfg)
+		return -ENOMEM;
+	memcpy(cfg, staged, sizeof(*cfg));
+
+	old = rcu_dereference_protected(stream->config,
+					lockdep_is_held(&aes67_config_mutex));
+	if (stream->direction == AES67_STREAM_RX &&
+	    (memcmp(&old->addr, &cfg->addr, sizeof(cfg->addr)) ||
+	     memcmp(&old->source, &cfg->source, sizeof(cfg->source)))) {
+		err = aes67_rtp_stream_bind(stream, cfg);
+		if (err < 0) {
+			kfree(cfg);
+			return err;
+		}
 	}
 
+	spin_lock(&stream->lock);
+	rcu_assign_pointer(stream->config, cfg);
+	/* keep routes inside the new channel count */
+	for (c = 0; c < AES67_PCM_CHANNELS; c++)
+		stream->route[c] = min_t(unsigned int, stream->route[c],
+					 cfg->channels - 1);
+	aes67_rtp_stream_update_identity(stream);
+	if (stream->direction == AES67_STREAM_TX && cfg->ssrc)
+		stream->sync_source = cfg->ssrc;
+	spin_unlock(&stream->lock);
+
+	call_srcu(&aes67_config_srcu, &old->rcu, aes67_stream_config_free_rcu);
+	return 0;
+}
+
+static int aes67_rtp_stream_create(struct aes67_rtp_stream **stream,
+				   int direction)
+{
+	struct aes67_rtp_stream *strm;
+	struct aes67_stream_config *cfg;
+	struct page *page;
+	int err, c, node, cpu;
+
+	aes67_rtp_stream_placement(&node, &cpu);
+
+	strm = kzalloc_node(sizeof(*strm), GFP_KERNEL, node);
+	if (!strm)
+		return -ENOMEM;
+
+	spin_lock_init(&strm->lock);
+	strm->node = node;
+	strm->cpu = cpu;
+	strm->head = kzalloc_node(sizeof(*strm->head), GFP_KERNEL, node);
+	if (!strm->head) {
+		kfree(strm);
+		return -ENOMEM;
+	}
+	atomic_set(strm->head, 0);
+	strm->direction = direction;
+	INIT_WORK(&strm->work, aes67_rtp_rx);
+	INIT_DELAYED_WORK(&strm->tx_work, aes67_rtp_tx_net);
+
+	cfg = kzalloc_node(sizeof(*cfg), GFP_KERNEL, node);
+	if (!cfg) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	RCU_INIT_POINTER(strm->config, cfg);
+	err = aes67_stream_config_init(cfg, direction);
+	if (err < 0)
+		goto fail;
+
+	for (c = 0; c < AES67_PCM_CHANNELS; c++) {
+		strm->route[c] = min_t(unsigned int, c, cfg->channels - 1);
+		strm->gain[c] = AES67_GAIN_UNITY;
+	}
+	aes67_rtp_stream_update_identity(strm);
+
+	if (direction == AES67_STREAM_TX) {
+		/* create socket */
+		err = sock_create_kern(&init_net, PF_INET, SOCK_DGRAM,
+				       IPPROTO_UDP, &strm->socket);
+		if (err < 0) {
+			printk(KERN_ERR "Failed to create socket for stream\n");
+			goto fail;
+		}
+
+		strm->sync_source = get_random_u32();
+		strm->sequence = get_random_u16();
+
+		if (tx_txtime) {
+			struct sock_txtime txtime = { .clockid = CLOCK_TAI };
+
+			err = sock_setsockopt(strm->socket, SOL_SOCKET,
+					      SO_TXTIME, KERNEL_SOCKPTR(&txtime),
+					      sizeof(txtime));
+			if (err < 0) {
+				printk(KERN_ERR
+				       "Failed to enable SO_TXTIME on TX stream\n");
+				goto fail;
+			}
+			strm->txtime = true;
+		}
+
+		*stream = strm;
+		return 0;
+	}
+
+	strm->rx_buf = kzalloc_node(AES67_RECV_BUF_SIZE, GFP_KERNEL, node);
+	if (!strm->rx_buf) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* physically contiguous so the PCM core can map it to readers */
+	INIT_LIST_HEAD(&strm->readers);
+	page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO,
+				get_order(AES67_RX_RING_BYTES));
+	if (!page) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	strm->ring.dev.type = SNDRV_DMA_TYPE_CONTINUOUS;
+	strm->ring.area = page_address(page);
+	strm->ring.addr = page_to_phys(page);
+	strm->ring.bytes = AES67_RX_RING_BYTES;
+
+	err = aes67_rtp_stream_bind(strm, cfg);
+	if (err < 0)
+		goto fail;
+
 	*stream = strm;
 	return 0;
+
+fail:
+	aes67_rtp_stream_free(strm);
+	return err;
+}
+
+///
+/// Configfs
+///
+
+/*
+ * Every directory under /config/snd-aes67/ is one stream configuration.
+ * Writing 1 to enable publishes it to the card stream of its direction,
+ * from then on each attribute write is applied live. Disabling or removing
+ * it puts the module parameter defaults back.
+ */
+struct aes67_cfs_stream {
+	struct config_item item;
+	int direction;
+	bool enabled;
+	struct aes67_stream_config cfg;
+};
+
+/* card the configurations are applied to, and who is bound to it */
+static struct snd_aes67_vhw *aes67_cfs_card;
+static struct aes67_cfs_stream *aes67_cfs_bound[2];
+
+static inline struct aes67_cfs_stream *
+to_aes67_cfs_stream(struct config_item *item)
+{
+	return container_of(item, struct aes67_cfs_stream, item);
+}
+
+static void aes67_configfs_set_card(struct snd_aes67_vhw *virtcard)
+{
+	mutex_lock(&aes67_config_mutex);
+	aes67_cfs_card = virtcard;
+	aes67_cfs_bound[AES67_STREAM_RX] = NULL;
+	aes67_cfs_bound[AES67_STREAM_TX] = NULL;
+	mutex_unlock(&aes67_config_mutex);
+}
+
+static struct aes67_rtp_stream *aes67_cfs_card_stream(int direction)
+{
+	if (!aes67_cfs_card)
+		return NULL;
+	if (direction == AES67_STREAM_TX)
+		return aes67_cfs_card->tx;
+	return aes67_cfs_card->rx;
+}
+
+/* Put the module parameter configuration back on a card stream */
+static int aes67_cfs_unbind(struct aes67_cfs_stream *cs)
+{
+	struct aes67_rtp_stream *stream = aes67_cfs_card_stream(cs->direction);
+	struct aes67_stream_config *cfg;
+	int err;
+
+	cs->enabled = false;
+	if (aes67_cfs_bound[cs->direction] != cs)
+		return 0;
+	aes67_cfs_bound[cs->direction] = NULL;
+	if (!stream)
+		return 0;
+
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+	err = aes67_stream_config_init(cfg, cs->direction);
+	if (!err)
+		err = aes67_rtp_stream_apply(stream, cfg);
+	kfree(cfg);
+	return err;
+}
+
+/* Run update on a copy of the staged config and apply it if enabled */
+static ssize_t aes67_cfs_update(struct config_item *item, const char *page,
+				size_t len,
+				int (*update)(struct aes67_stream_config *cfg,
+					      int direction, const char *page))
+{
+	struct aes67_cfs_stream *cs = to_aes67_cfs_stream(item);
+	struct aes67_rtp_stream *stream;
+	struct aes67_stream_config *cfg;
+	int err;
+
+	mutex_lock(&aes67_config_mutex);
+	cfg = kmemdup(&cs->cfg, sizeof(*cfg), GFP_KERNEL);
+	if (!cfg) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = update(cfg, cs->direction, page);
+	if (err < 0)
+		goto out;
+	err = aes67_stream_config_check(cfg);
+	if (err < 0)
+		goto out;
+
+	if (cs->enabled) {
+		stream = aes67_cfs_card_stream(cs->direction);
+		if (stream) {
+			err = aes67_rtp_stream_apply(stream, cfg);
+			if (err < 0)
+				goto out;
+		}
+	}
+	memcpy(&cs->cfg, cfg, sizeof(*cfg));
+
+out:
+	mutex_unlock(&aes67_config_mutex);
+	kfree(cfg);
+	return err < 0 ? err : len;
+}
+
+#define AES67_CFS_UINT_ATTR(_name)                                             \
+	static int aes67_cfs_parse_##_name(struct aes67_stream_config *cfg,    \
+					   int direction, const char *page)    \
+	{                                                                      \
+		return kstrtouint(page, 0, &cfg->_name);                       \
+	}                                                                      \
+	static ssize_t aes67_cfs_stream_##_name##_show(                        \
+		struct config_item *item, char *page)                          \
+	{                                                                      \
+		return sprintf(page, "%u\n",                                   \
+			       to_aes67_cfs_stream(item)->cfg._name);          \
+	}                                                                      \
+	static ssize_t aes67_cfs_stream_##_name##_store(                       \
+		struct config_item *item, const char *page, size_t len)        \
+	{                                                                      \
+		return aes67_cfs_update(item, page, len,                       \
+					aes67_cfs_parse_##_name);              \
+	}                                                                      \
+	CONFIGFS_ATTR(aes67_cfs_stream_, _name)
+
+AES67_CFS_UINT_ATTR(ssrc);
+AES67_CFS_UINT_ATTR(payload_type);
+AES67_CFS_UINT_ATTR(ptime_frames);
+AES67_CFS_UINT_ATTR(channels);
+AES67_CFS_UINT_ATTR(link_offset);
+AES67_CFS_UINT_ATTR(clock_offset);
+
+static int aes67_cfs_parse_port(struct aes67_stream_config *cfg,
+				int direction, const char *page)
+{
+	u16 port;
+	int err;
+
+	/* TX: default for dests listed later, listed ones keep theirs */
+	err = kstrtou16(page, 0, &port);
+	if (err)
+		return err;
+
+	aes67_sockaddr_set_port(&cfg->addr, port);
+	return 0;
+}
+
+static ssize_t aes67_cfs_stream_port_show(struct config_item *item,
+					  char *page)
+{
+	return sprintf(page, "%u\n",
+		       aes67_sockaddr_port(&to_aes67_cfs_stream(item)->cfg.addr));
+}
+
+static ssize_t aes67_cfs_stream_port_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	return aes67_cfs_update(item, page, len, aes67_cfs_parse_port);
+}
+
+/*
+ * RX: the IPv4 or IPv6 address to listen on. TX: whitespace separated
+ * IPv4 addr[:port] list of receivers, entries without a port use the
+ * stream port.
+ */
+static int aes67_cfs_parse_address(struct aes67_stream_config *cfg,
+				   int direction, const char *page)
+{
+	u16 port = aes67_sockaddr_port(&cfg->addr);
+	union aes67_sockaddr addr;
+	char *buf, *cur, *tok;
+	bool first = true;
+	int err = 0;
+
+	buf = kstrdup(page, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cfg->num_dests = 0;
+	cur = strim(buf);
+	while ((tok = strsep(&cur, " \t\n,")) != NULL) {
+		if (!*tok)
+			continue;
+		err = aes67_parse_addr(tok, &addr, port);
+		if (err < 0)
+			break;
+
+		/* the first entry doubles as the RX listen address */
+		if (first) {
+			cfg->addr = addr;
+			first = false;
+		}
+		if (addr.sa.sa_family != AF_INET) {
+			if (direction == AES67_STREAM_RX)
+				continue;
+			/* TX destinations are IPv4 only */
+			err = -EAFNOSUPPORT;
+			break;
+		}
+		if (cfg->num_dests == AES67_MAX_DESTS) {
+			err = -ENOSPC;
+			break;
+		}
+		cfg->dests[cfg->num_dests++] = addr.v4;
+	}
+
+	if (!err && first)
+		err = -EINVAL;
+
+	/* the source belongs to the old group */
+	if (!err && cfg->source.sa.sa_family != cfg->addr.sa.sa_family)
+		memset(&cfg->source, 0, sizeof(cfg->source));
+
+	kfree(buf);
+	return err;
+}
+
+static ssize_t aes67_cfs_stream_address_show(struct config_item *item,
+					     char *page)
+{
+	struct aes67_cfs_stream *cs = to_aes67_cfs_stream(item);
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&aes67_config_mutex);
+	if (cs->direction == AES67_STREAM_RX) {
+		len = sprintf(page, "%pISc\n", &cs->cfg.addr.sa);
+	} else {
+		for (i = 0; i < cs->cfg.num_dests; i++)
+			len += scnprintf(page + len, PAGE_SIZE - len,
+					 "%pI4:%u\n",
+					 &cs->cfg.dests[i].sin_addr,
+					 ntohs(cs->cfg.dests[i].sin_port));
+	}
+	mutex_unlock(&aes67_config_mutex);
+	return len;
+}
+
+static ssize_t aes67_cfs_stream_address_store(struct config_item *item,
+					      const char *page, size_t len)
+{
+	return aes67_cfs_update(item, page, len, aes67_cfs_parse_address);
+}
+
+/* RX: sender for source-specific multicast, "any" to take every sender */
+static int aes67_cfs_parse_source(struct aes67_stream_config *cfg,
+				  int direction, const char *page)
+{
+	char *buf = kstrdup(page, GFP_KERNEL);
+	int err = 0;
+
+	if (!buf)
+		return -ENOMEM;
+
+	if (!*strim(buf) || sysfs_streq(buf, "any"))
+		memset(&cfg->source, 0, sizeof(cfg->source));
+	else
+		err = aes67_parse_addr(strim(buf), &cfg->source, 0);
+
+	kfree(buf);
+	return err;
+}
+
+static ssize_t aes67_cfs_stream_source_show(struct config_item *item,
+					    char *page)
+{
+	struct aes67_cfs_stream *cs = to_aes67_cfs_stream(item);
+	ssize_t len;
+
+	mutex_lock(&aes67_config_mutex);
+	if (cs->cfg.source.sa.sa_family == AF_UNSPEC)
+		len = sprintf(page, "any\n");
+	else
+		len = sprintf(page, "%pISc\n", &cs->cfg.source.sa);
+	mutex_unlock(&aes67_config_mutex);
+	return len;
+}
+
+static ssize_t aes67_cfs_stream_source_store(struct config_item *item,
+					     const char *page, size_t len)
+{
+	return aes67_cfs_update(item, page, len, aes67_cfs_parse_source);
+}
+
+static ssize_t aes67_cfs_stream_direction_show(struct config_item *item,
+					       char *page)
+{
+	return sprintf(page, "%s\n",
+		       to_aes67_cfs_stream(item)->direction == AES67_STREAM_TX ?
+			       "tx" :
+			       "rx");
+}
+
+static ssize_t aes67_cfs_stream_direction_store(struct config_item *item,
+						const char *page, size_t len)
+{
+	struct aes67_cfs_stream *cs = to_aes67_cfs_stream(item);
+	struct aes67_stream_config *cfg;
+	int direction, err = 0;
+
+	if (sysfs_streq(page, "rx"))
+		direction = AES67_STREAM_RX;
+	else if (sysfs_streq(page, "tx"))
+		direction = AES67_STREAM_TX;
+	else
+		return -EINVAL;
+
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+
+	/*
+	 * direction picks the card stream, so it is fixed while bound. The
+	 * other direction's settings do not carry over, start again from the
+	 * module parameters.
+	 */
+	mutex_lock(&aes67_config_mutex);
+	if (cs->enabled)
+		err = -EBUSY;
+	else if (direction != cs->direction)
+		err = aes67_stream_config_init(cfg, direction);
+	if (!err && direction != cs->direction) {
+		memcpy(&cs->cfg, cfg, sizeof(*cfg));
+		cs->direction = direction;
+	}
+	mutex_unlock(&aes67_config_mutex);
+	kfree(cfg);
+	return err < 0 ? err : len;
+}
+
+static ssize_t aes67_cfs_stream_enable_show(struct config_item *item,
+					    char *page)
+{
+	return sprintf(page, "%d\n", to_aes67_cfs_stream(item)->enabled);
+}
+
+static ssize_t aes67_cfs_stream_enable_store(struct config_item *item,
+					     const char *page, size_t len)
+{
+	struct aes67_cfs_stream *cs = to_aes67_cfs_stream(item);
+	struct aes67_rtp_stream *stream;
+	bool enable;
+	int err;
+
+	err = kstrtobool(page, &enable);
+	if (err)
+		return err;
+
+	mutex_lock(&aes67_config_mutex);
+	if (!enable) {
+		err = aes67_cfs_unbind(cs);
+		goto out;
+	}
+
+	/* one configuration per card stream, the other must let go first */
+	if (aes67_cfs_bound[cs->direction] &&
+	    aes67_cfs_bound[cs->direction] != cs) {
+		err = -EBUSY;
+		goto out;
+	}
+	if (cs->direction == AES67_STREAM_TX && !cs->cfg.num_dests) {
+		err = -EDESTADDRREQ;
+		goto out;
+	}
+
+	stream = aes67_cfs_card_stream(cs->direction);
+	if (!stream) {
+		err = -ENODEV;
+		goto out;
+	}
+	err = aes67_rtp_stream_apply(stream, &cs->cfg);
+	if (err < 0)
+		goto out;
+
+	aes67_cfs_bound[cs->direction] = cs;
+	cs->enabled = true;
+
+out:
+	mutex_unlock(&aes67_config_mutex);
+	return err < 0 ? err : len;
+}
+
+CONFIGFS_ATTR(aes67_cfs_stream_, port);
+CONFIGFS_ATTR(aes67_cfs_stream_, address);
+CONFIGFS_ATTR(aes67_cfs_stream_, source);
+CONFIGFS_ATTR(aes67_cfs_stream_, direction);
+CONFIGFS_ATTR(aes67_cfs_stream_, enable);
+
+static struct configfs_attribute *aes67_cfs_stream_attrs[] = {
+	&aes67_cfs_stream_attr_direction,
+	&aes67_cfs_stream_attr_address,
+	&aes67_cfs_stream_attr_source,
+	&aes67_cfs_stream_attr_port,
+	&aes67_cfs_stream_attr_ssrc,
+	&aes67_cfs_stream_attr_payload_type,
+	&aes67_cfs_stream_attr_ptime_frames,
+	&aes67_cfs_stream_attr_channels,
+	&aes67_cfs_stream_attr_link_offset,
+	&aes67_cfs_stream_attr_clock_offset,
+	&aes67_cfs_stream_attr_enable,
+	NULL,
+};
+
+static void aes67_cfs_stream_release(struct config_item *item)
+{
+	kfree(to_aes67_cfs_stream(item));
+}
+
+static struct configfs_item_operations aes67_cfs_stream_ops = {
+	.release = aes67_cfs_stream_release,
+};
+
+static const struct config_item_type aes67_cfs_stream_type = {
+	.ct_item_ops = &aes67_cfs_stream_ops,
+	.ct_attrs = aes67_cfs_stream_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_item *aes67_cfs_make_stream(struct config_group *group,
+						 const char *name)
+{
+	struct aes67_cfs_stream *cs;
+	int err;
+
+	cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+	if (!cs)
+		return ERR_PTR(-ENOMEM);
+
+	cs->direction = AES67_STREAM_RX;
+	err = aes67_stream_config_init(&cs->cfg, cs->direction);
+	if (err < 0) {
+		kfree(cs);
+		return ERR_PTR(err);
+	}
+
+	config_item_init_type_name(&cs->item, name, &aes67_cfs_stream_type);
+	return &cs->item;
+}
+
+static void aes67_cfs_drop_stream(struct config_group *group,
+				  struct config_item *item)
+{
+	mutex_lock(&aes67_config_mutex);
+	aes67_cfs_unbind(to_aes67_cfs_stream(item));
+	mutex_unlock(&aes67_config_mutex);
+	config_item_put(item);
+}
+
+static struct configfs_group_operations aes67_cfs_group_ops = {
+	.make_item = aes67_cfs_make_stream,
+	.drop_item = aes67_cfs_drop_stream,
+};
+
+static const struct config_item_type aes67_cfs_subsys_type = {
+	.ct_group_ops = &aes67_cfs_group_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem aes67_cfs_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = "snd-aes67",
+			.ci_type = &aes67_cfs_subsys_type,
+		},
+	},
+};
+
+static int aes67_configfs_register(void)
+{
+	config_group_init(&aes67_cfs_subsys.su_group);
+	mutex_init(&aes67_cfs_subsys.su_mutex);
+	return configfs_register_subsystem(&aes67_cfs_subsys);
+}
+
+static void aes67_configfs_unregister(void)
+{
+	configfs_unregister_subsystem(&aes67_cfs_subsys);
 }
 
 ///
@@ -620,6 +2596,7 @@ static int aes67_rtp_stream_create(struct aes67_rtp_stream **stream)
 /* Module init and exit functions */
 static int __init alsa_card_aes67_init(void)
 {
+	struct platform_device *device;
 	int err;
 
 	//Add driver to registry
@@ -634,34 +2611,54 @@ static int __init alsa_card_aes67_init(void)
 	err = aes67_rtp_work_start();
 	if (err < 0) {
 		printk(KERN_ERR "FAILED to start workqueue for AES67\n");
-		return err;
+		goto err_driver;
 	}
 
 	//register a card in the kernel
-	struct platform_device *device;
 	device = platform_device_register_simple(SND_AES67_DRIVER, 0, NULL, 0);
 	if (IS_ERR(device)) {
 		printk(KERN_ERR "Failed to register AES67 Device\n");
-		return -ENODEV;
+		err = -ENODEV;
+		goto err_work;
 	}
 	if (!platform_get_drvdata(device)) {
 		printk(KERN_ERR "No device data for AES67\n");
-		platform_device_unregister(device);
-		return -ENODEV;
+		err = -ENODEV;
+		goto err_device;
 	}
 	devices[0] = device;
 
+	/* Runtime stream configuration */
+	err = aes67_configfs_register();
+	if (err < 0) {
+		printk(KERN_ERR "FAILED to register configfs for AES67\n");
+		goto err_device;
+	}
+
 	return 0;
+
+err_device:
+	platform_device_unregister(device);
+	devices[0] = NULL;
+err_work:
+	aes67_rtp_work_stop();
+err_driver:
+	platform_driver_unregister(&snd_aes67_driver);
+	return err;
 }
 
 static void __exit alsa_card_aes67_exit(void)
 {
+	printk(KERN_INFO "Attempting to unregister configfs for AES67\n");
+	aes67_configfs_unregister();
 	printk(KERN_INFO "Attempting to unregister card for AES67\n");
 	platform_device_unregister(devices[0]);
 	printk(KERN_INFO "Attempting to unregistered driver for AES67\n");
 	platform_driver_unregister(&snd_aes67_driver);
 	printk(KERN_INFO "Attempting to stop workqueue for AES67\n");
 	aes67_rtp_work_stop();
+	/* retired stream configurations */
+	srcu_barrier(&aes67_config_srcu);
 }
 
 module_init(alsa_card_aes67_init) module_exit(alsa_card_aes67_exit)